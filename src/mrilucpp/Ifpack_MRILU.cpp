@@ -65,9 +65,11 @@ extern "C"
 
 Ifpack_MRILU::Ifpack_MRILU(Teuchos::RCP<Epetra_CrsMatrix> A, Teuchos::RCP<Epetra_Comm> comm_) : 
 	mrilu_id(0),
+	mrilu_id_trans(0),
 	Matrix_(A),
 	comm(comm_),
-	is_initialized(false),is_computed(false)
+	is_initialized(false),is_computed(false),
+	use_transpose(false),is_computed_trans(false)
 {  
     std::string s1="MRILU(";
     std::string s2(A->Label());
@@ -79,7 +81,9 @@ Ifpack_MRILU::Ifpack_MRILU(Teuchos::RCP<Epetra_CrsMatrix> A, Teuchos::RCP<Epetra
 
 Ifpack_MRILU::Ifpack_MRILU(Epetra_RowMatrix* A) :
 	mrilu_id(0),
-	is_initialized(false),is_computed(false)
+	mrilu_id_trans(0),
+	is_initialized(false),is_computed(false),
+	use_transpose(false),is_computed_trans(false)
 {  
     std::string s1="MRILU(";
     std::string s2(A->Label());
@@ -104,10 +108,17 @@ Ifpack_MRILU::~Ifpack_MRILU()
 		DEBUG("Destroy MRILU preconditioner...\n");
 #ifdef HAVE_IFPACK_MRILU
 		mrilucpp_destroy(&mrilu_id);
+#endif
+    }    
+	if (mrilu_id_trans>0)
+    {
+#ifdef HAVE_IFPACK_MRILU
+		mrilucpp_destroy(&mrilu_id_trans);
 #endif
     }    
 	is_initialized=false;
 	is_computed=false;
+	is_computed_trans=false;
 }
 
 //////////////
@@ -190,6 +201,10 @@ ApplyInverse(const Epetra_MultiVector& input,
     }
 	if (&input == &result)
 		Error("aliased call to Ifpack_MRILU::ApplyInverse",__FILE__,__LINE__);
+	if (use_transpose && !is_computed_trans)
+    {
+		Error("Ifpack_MRILU not yet computed for the transpose!",__FILE__,__LINE__);
+    }
 	
 	DEBUG("+++ Enter Ifpack_MRILU::ApplyInverse");
 	if (input.NumVectors()!=1)
@@ -216,7 +231,10 @@ ApplyInverse(const Epetra_MultiVector& input,
 		result = input;
 	else
 	{
-		mrilucpp_apply(&mrilu_id, &n, rhs_array,sol_array);
+		if (use_transpose)
+			mrilucpp_apply(&mrilu_id_trans, &n, rhs_array,sol_array);
+		else
+			mrilucpp_apply(&mrilu_id, &n, rhs_array,sol_array);
 	}
 	
 	//for (int i=0;i<n;i++)    result[0][i]=sol_array[i];
@@ -271,24 +289,118 @@ int Ifpack_MRILU::Initialize()
 {
 	DEBUG("+++ Enter Ifpack_MRILU::Initialize");
 
+	DEBUG("Create preconditioner...");	
+	create_instance(mrilu_id, false);
+
+	// the transposed instance is only maintained once it has been requested
+	if (use_transpose || mrilu_id_trans>0)
+    {
+		DEBUG("Create preconditioner for the transpose...");	
+		create_instance(mrilu_id_trans, true);
+    }
+	is_computed_trans = false;
+	is_initialized = true;
+	DEBUG("+++ Leave Ifpack_MRILU::Initialize");
+	return 0;
+}
+
+//! Returns true if the  preconditioner has been successfully initialized, false otherwise.
+bool Ifpack_MRILU::IsInitialized() const
+{
+    return is_initialized;
+}
+
+//! Computes all it is necessary to apply the preconditioner.
+int Ifpack_MRILU::Compute()
+{
+    DEBUG("Enter Ifpack_MRILU::Compute");
+
+#ifdef HAVE_IFPACK_MRILU
+
+	//note: needs_setup is ignored up to now
+
+	if (comm->NumProc()>1)
+    {
+		// this class should be run through an Ifpack_LocalFilter or the like:
+		this->Error("The MRILU preconditioner is not intended for parallel use!",__FILE__,__LINE__);
+    }
+
+	if (!this->IsInitialized()) this->Initialize();
+
+	if (outlev>3)
+    {
+		std::cout << "Compute " << label << std::endl;
+    }
+	compute_instance(mrilu_id);
+
+	if (use_transpose && mrilu_id_trans==0)
+    {
+		create_instance(mrilu_id_trans, true);
+    }
+	if (mrilu_id_trans>0)
+    {
+		if (outlev>3)
+        {
+			std::cout << "Compute transpose of " << label << std::endl;
+        }
+		compute_instance(mrilu_id_trans);
+		is_computed_trans=true;
+    }
+  
+	// after building the preconditioner, the internal csr matrix is destroyed
+	is_computed=true;
+	is_initialized=false; // always have to re-initialize before calling Compute again!
+
+#else
+	std::cout << "WARNING: MRILU is not available, using identity!"<<std::endl;
+	is_computed_trans=true;
+#endif    
+    DEBUG("Leave Ifpack_MRILU::Compute");
+    return 0;
+}
+
+int Ifpack_MRILU::SetUseTranspose(bool UseTranspose)
+{
+	use_transpose = UseTranspose;
+
+	// build the factorization of A' next to the existing one
+	// of A, the latter stays available for forward solves.
+	if (use_transpose && is_computed && !is_computed_trans)
+    {
+#ifdef HAVE_IFPACK_MRILU
+		create_instance(mrilu_id_trans, true);
+		if (outlev>3)
+        {
+			std::cout << "Compute transpose of " << label << std::endl;
+        }
+		compute_instance(mrilu_id_trans);
+#endif
+		is_computed_trans = true;
+    }
+	return 0;
+}
+
+bool Ifpack_MRILU::extract_crs(std::vector<int>& beg, std::vector<int>& jco,
+							   std::vector<double>& co, bool transpose) const
+{
 	// extract CRS array of the local Jacobian.
 	int nnz   = Matrix_->NumMyNonzeros();
 	int nrows = Matrix_->NumMyRows();
   
+	beg.resize(nrows+1);
+	jco.resize(nnz);
+	co.resize(nnz);
+
 	// although we might get CRS arrays directly from Epetra,
 	// this method is preferred because it is implementation independent
-	int* beg   = new int[nrows+1];
-	int* jco   = new int[nnz];
-	double* co = new double[nnz];
-  
 	int len;
 	beg[0]  = 0;
 	int idx = 0;
-	is_identity = true;
+	bool is_identity = true;
 
 	for (int i = 0; i < nrows; i++)
     {
-		CHECK_ZERO(Matrix_->ExtractMyRowCopy(i, nnz-beg[i], len, co+beg[i], jco+beg[i]));
+		CHECK_ZERO(Matrix_->ExtractMyRowCopy(i, nnz-beg[i], len, &co[beg[i]], &jco[beg[i]]));
 		beg[i+1] = beg[i] + len;
 		
 		// Check whether this matrix is the identity
@@ -307,50 +419,58 @@ int Ifpack_MRILU::Initialize()
 		}
     }
 
-	DEBUG("Create preconditioner...");	
+	if (transpose)
+    {
+		// the local matrix is square (we are used on a local filter),
+		// so we can simply convert CRS to CCS
+		std::vector<int>    begT(nrows+1, 0);
+		std::vector<int>    jcoT(nnz);
+		std::vector<double> coT(nnz);
+
+		for (int k = 0; k < beg[nrows]; k++)
+			begT[jco[k]+1]++;
+		for (int i = 0; i < nrows; i++)
+			begT[i+1] += begT[i];
+
+		std::vector<int> pos(begT.begin(), begT.end()-1);
+		for (int i = 0; i < nrows; i++)
+			for (int k = beg[i]; k < beg[i+1]; k++)
+			{
+				int dest   = pos[jco[k]]++;
+				jcoT[dest] = i;
+				coT[dest]  = co[k];
+			}
+		beg.swap(begT);
+		jco.swap(jcoT);
+		co.swap(coT);
+    }
+	return is_identity;
+}
+
+void Ifpack_MRILU::create_instance(int& id, bool transpose)
+{
+	std::vector<int> beg, jco;
+	std::vector<double> co;
+	is_identity = extract_crs(beg, jco, co, transpose);
 
 #ifdef HAVE_IFPACK_MRILU
+	int nrows = beg.size()-1;
+	int nnz   = beg[nrows];
 	// the loca 'Reuse Policy' doesn't work for user
 	// defined preconditioners, it seems. They just 
 	// call this function whenever they want a new precond.
-	mrilucpp_destroy(&mrilu_id);
+	mrilucpp_destroy(&id);
 	// note that the conversion to 1-based indexing is done in fortran:
-	mrilucpp_create(&mrilu_id, &nrows, &nnz, beg, jco, co);
+	mrilucpp_create(&id, &nrows, &nnz, &beg[0],
+					nnz ? &jco[0] : NULL, nnz ? &co[0] : NULL);
 #endif    
-
-	delete [] beg;
-	delete [] co;
-	delete [] jco;
-	is_initialized = true;
-	DEBUG("+++ Leave Ifpack_MRILU::Initialize");
-	return 0;
 }
 
-//! Returns true if the  preconditioner has been successfully initialized, false otherwise.
-bool Ifpack_MRILU::IsInitialized() const
+void Ifpack_MRILU::compute_instance(int& id)
 {
-    return is_initialized;
-}
-
-//! Computes all it is necessary to apply the preconditioner.
-int Ifpack_MRILU::Compute()
-{
-    DEBUG("Enter Ifpack_MRILU::Compute");
-
 #ifdef HAVE_IFPACK_MRILU
-
-	//note: needs_setup is ignored up to now
-
-	if (comm->NumProc()>1)
-    {
-		// this class should be run through an Ifpack_LocalFilter or the like:
-		this->Error("The MRILU preconditioner is not intended for parallel use!",__FILE__,__LINE__);
-    }
-
-	if (!this->IsInitialized()) this->Initialize();
-
 	DEBUG("set parameters...");
-	mrilucpp_set_params( &mrilu_id, &blocksize, &cutmck ,  &scarow ,  &xactelm ,  
+	mrilucpp_set_params( &id, &blocksize, &cutmck ,  &scarow ,  &xactelm ,  
 						 &clsonce,  &nlsfctr,  
 						 &epsw   ,  &elmfctr,  &gusmod  ,  &gusfctr,  &redfctr,
 						 &schtol ,  &denslim,  &globfrac,  &locfrac,  &sparslim,
@@ -358,22 +478,9 @@ int Ifpack_MRILU::Compute()
 						 &singlu ,  &outlev);
 
 	DEBUG("Compute factorization...");
-	if (outlev>3)
-    {
-		std::cout << "Compute " << label << std::endl;
-    }
-	mrilucpp_compute(&mrilu_id);  
+	mrilucpp_compute(&id);  
 	DEBUG("done!");
-  
-	// after building the preconditioner, the internal csr matrix is destroyed
-	is_computed=true;
-	is_initialized=false; // always have to re-initialize before calling Compute again!
-
-#else
-	std::cout << "WARNING: MRILU is not available, using identity!"<<std::endl;
-#endif    
-    DEBUG("Leave Ifpack_MRILU::Compute");
-    return 0;
+#endif
 }
 
 //! Returns true if the  preconditioner has been successfully computed, false otherwise.
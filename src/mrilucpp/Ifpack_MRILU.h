@@ -22,6 +22,7 @@
 
 #include "Teuchos_ParameterList.hpp"
 #include "Teuchos_RCP.hpp"
+#include <vector>
 #include "Ifpack_Preconditioner.h"
 
 
@@ -48,13 +49,14 @@ public:
 	//! Destructor
 	virtual ~Ifpack_MRILU();
       
-	//! Set transpose (not implemented => returns -1).
-	int SetUseTranspose(bool UseTranspose) 
-	{
-        // return 0 (success) if transpose not requested,
-        // otherwise -1 (transpose is not available)
-        return -(int)UseTranspose;
-	}
+	//! Set transpose.
+
+	//! MRILU itself only offers a forward solve, so for the transpose
+	//! a second MRILU instance is built from the transposed local matrix.
+	//! This is done on the first request (or in Compute() if the flag
+	//! is already set) and kept up to date by subsequent Compute() calls,
+	//! so that a transposed ApplyInverse costs the same as the forward one.
+	int SetUseTranspose(bool UseTranspose);
       
 	//! Apply MRILU preconditioning operator (not implemented)
 	int Apply(const Epetra_MultiVector& X, Epetra_MultiVector& Y) const;
@@ -69,7 +71,7 @@ public:
 	const char* Label() const {return label.c_str();}
       
 	//! Transpose
-	bool UseTranspose() const {return false;}
+	bool UseTranspose() const {return use_transpose;}
       
 	//! Have norm-inf
 	bool HasNormInf() const {return false;}
@@ -180,6 +182,10 @@ protected:
 	//! stays the same ever after and is passed to all fortran
 	//! calls.
 	int mrilu_id;
+
+	//! identifies the instance holding the factorization of the
+	//! transposed matrix (0 if it has never been requested)
+	int mrilu_id_trans;
     
 	//! the matrix of the linear system we want to precondition
 	Teuchos::RCP<Epetra_RowMatrix> Matrix_;
@@ -192,6 +198,12 @@ protected:
 
 	//! mrilu computed
 	bool is_computed;
+
+	//! apply the inverse of the transposed matrix
+	bool use_transpose;
+
+	//! mrilu computed for the transposed matrix
+	bool is_computed_trans;
       
 	//! condition number estimate
 	double condest;
@@ -237,6 +249,17 @@ private:
             
 	//! set default values for MRILU params
 	void default_params();      
+
+	//! extract the local CRS arrays of our matrix (or of its transpose).
+	//! returns true if the matrix is the identity.
+	bool extract_crs(std::vector<int>& beg, std::vector<int>& jco,
+					 std::vector<double>& co, bool transpose) const;
+
+	//! pass the local (transposed) matrix to a new MRILU instance
+	void create_instance(int& id, bool transpose);
+
+	//! set parameters and compute the factorization for an instance
+	void compute_instance(int& id);
   
 	//! Error function. We don't use the one from Trilinos-THCM
 	//! to avoid a dependency on its Filestreams/globdefs      
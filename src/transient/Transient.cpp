@@ -4,10 +4,12 @@
 #include "Teuchos_Utils.hpp"
 
 #include "Epetra_Comm.h"
+#include "Epetra_MpiComm.h"
 #include "Epetra_Vector.h"
 #include "Epetra_Import.h"
 #include "EpetraExt_HDF5.h"
 
+#include <cstdio>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -16,6 +18,10 @@
 
 #include "Trilinos_version.h"
 
+#include "Utils.H"
+
+#include <mpi.h>
+
 std::string mem2string(long long mem)
 {
     double value = mem;
@@ -32,6 +38,75 @@ std::string mem2string(long long mem)
     return ss.str();
 }
 
+// Tag of the states that are sent between groups
+#define TRANSIENT_TRANSFER_TAG 11
+
+void set_transient_groups(
+    Transient<Teuchos::RCP<const Epetra_Vector> > &transient,
+    Teuchos::RCP<Epetra_Comm> comm, Teuchos::RCP<Epetra_Comm> groupComm,
+    int numGroups, int group)
+{
+    bool root = (groupComm->MyPID() == 0);
+
+    // ranks in comm of the first processes of the groups
+    std::vector<int> myRoots(numGroups, 0);
+    std::vector<int> roots(numGroups, 0);
+    if (root)
+        myRoots[group] = comm->MyPID();
+    CHECK_ZERO(comm->SumAll(&myRoots[0], &roots[0], numGroups));
+
+    MPI_Comm mpiComm = Teuchos::rcp_dynamic_cast<Epetra_MpiComm>(
+        comm, true)->GetMpiComm();
+
+    // The processes in a group have the same values, so only the
+    // first one contributes
+    auto sum = [comm, root](std::vector<double> &values) {
+        if (values.empty())
+            return;
+
+        std::vector<double> mine(values.size(), 0.0);
+        if (root)
+            mine = values;
+        CHECK_ZERO(comm->SumAll(&mine[0], &values[0], values.size()));
+    };
+
+    // The state is gathered on the first process of group from, sent
+    // to the first process of group to and distributed there
+    auto transfer = [group, root, roots, mpiComm](
+        Teuchos::RCP<const Epetra_Vector> const &x, int from, int to)
+        -> Teuchos::RCP<const Epetra_Vector> {
+        if (from == to || (group != from && group != to))
+            return x;
+
+        TIMER_SCOPE("Transient: transfer state");
+
+        if (group == from)
+        {
+            Teuchos::RCP<Epetra_MultiVector> gathered = Utils::Gather(*x, 0);
+            if (root)
+            {
+                CHECK_ZERO(MPI_Send((*gathered)[0], gathered->MyLength(), MPI_DOUBLE,
+                                    roots[to], TRANSIENT_TRANSFER_TAG, mpiComm));
+            }
+            return x;
+        }
+
+        Teuchos::RCP<Epetra_BlockMap> map = Utils::Gather(x->Map(), 0);
+        Epetra_Vector gathered(*map);
+        if (root)
+        {
+            CHECK_ZERO(MPI_Recv(gathered.Values(), gathered.MyLength(), MPI_DOUBLE,
+                                roots[from], TRANSIENT_TRANSFER_TAG, mpiComm,
+                                MPI_STATUS_IGNORE));
+        }
+
+        Teuchos::RCP<Epetra_MultiVector> y = Utils::Scatter(gathered, x->Map());
+        return Teuchos::rcp(new Epetra_Vector(*(*y)(0)));
+    };
+
+    transient.set_groups(numGroups, group, sum, transfer);
+}
+
 // This read/write mechanism need Trilinos pull request #3381, which
 // is present in Trilinos 12.14
 #if TRILINOS_MAJOR_MINOR_VERSION > 121300
@@ -188,7 +263,7 @@ void Transient<Teuchos::RCP<const Epetra_Vector> >::write(
             HDF5.CreateGroup("experiments/" + Teuchos::toString(i) + "/xlist");
             for (int j = 0; j < (int)experiments[i].xlist.size(); j++)
                 HDF5.Write("experiments/" + Teuchos::toString(i) +
-                           "/xlist/" + Teuchos::toString(j), *experiments[i].xlist[j]);
+                           "/xlist/" + Teuchos::toString(j), *load(experiments[i], j));
 
             HDF5.Write("experiments/" + Teuchos::toString(i), "dlist",
                        H5T_NATIVE_DOUBLE, experiments[i].dlist.size(),
@@ -212,4 +287,119 @@ void Transient<Teuchos::RCP<const Epetra_Vector> >::write(
     if (lock_file >= 0)
         close(lock_file);
 }
+
+template<>
+void Transient<Teuchos::RCP<const Epetra_Vector> >::spill(
+    std::vector<std::pair<AMSExperiment<Teuchos::RCP<const Epetra_Vector> > *,
+                          int> > const &states) const
+{
+    if (states.size() == 0)
+        return;
+
+    TIMER_SCOPE("Transient: spill states");
+
+    Epetra_Comm const &comm = states[0].first->x0->Comm();
+    EpetraExt::HDF5 HDF5(comm);
+    if (spill_count_ == 0)
+        HDF5.Create(spill_file_name());
+    else
+        HDF5.Open(spill_file_name());
+
+    for (auto &state: states)
+    {
+        AMSExperiment<Teuchos::RCP<const Epetra_Vector> > &exp = *state.first;
+        int idx = state.second;
+
+        HDF5.Write("states/" + Teuchos::toString(spill_count_), *exp.xlist[idx]);
+        exp.spilled[idx] = spill_count_++;
+        exp.xlist[idx] = Teuchos::null;
+    }
+
+    HDF5.Close();
+}
+
+template<>
+void Transient<Teuchos::RCP<const Epetra_Vector> >::compact_spill_file(
+    std::vector<AMSExperiment<Teuchos::RCP<const Epetra_Vector> > > &experiments) const
+{
+    if (spill_count_ == 0 || experiments.size() == 0)
+        return;
+
+    TIMER_SCOPE("Transient: compact spill file");
+
+    Epetra_Comm const &comm = experiments[0].x0->Comm();
+    std::string name = spill_file_name();
+
+    int num_spilled = 0;
+    for (auto &exp: experiments)
+        num_spilled += exp.spilled.size();
+
+    // Copy the states that are still spilled to a new file one at a
+    // time, so the memory budget is kept
+    if (num_spilled > 0)
+    {
+        std::string tmp_name = name + ".tmp";
+
+        EpetraExt::HDF5 from(comm);
+        EpetraExt::HDF5 to(comm);
+        from.Open(name);
+        to.Create(tmp_name);
+
+        int count = 0;
+        for (auto &exp: experiments)
+        {
+            for (auto &key: exp.spilled)
+            {
+                Epetra_MultiVector *tmp;
+                from.Read("states/" + Teuchos::toString(key.second), tmp);
+                to.Write("states/" + Teuchos::toString(count), *tmp);
+                delete tmp;
+                key.second = count++;
+            }
+        }
+
+        from.Close();
+        to.Close();
+
+        comm.Barrier();
+        if (comm.MyPID() == 0)
+            std::rename(tmp_name.c_str(), name.c_str());
+    }
+    else
+    {
+        // The next spill creates a new file
+        comm.Barrier();
+        if (comm.MyPID() == 0)
+            std::remove(name.c_str());
+    }
+    comm.Barrier();
+
+    spill_count_ = num_spilled;
+}
+
+template<>
+Teuchos::RCP<const Epetra_Vector> Transient<Teuchos::RCP<const Epetra_Vector> >::load(
+    AMSExperiment<Teuchos::RCP<const Epetra_Vector> > const &experiment, int idx) const
+{
+    auto key = experiment.spilled.find(idx);
+    if (key == experiment.spilled.end())
+        return experiment.xlist[idx];
+
+    TIMER_SCOPE("Transient: load states");
+
+    EpetraExt::HDF5 HDF5(experiment.x0->Comm());
+    HDF5.Open(spill_file_name());
+
+    Epetra_MultiVector *tmp;
+    HDF5.Read("states/" + Teuchos::toString(key->second), tmp);
+    HDF5.Close();
+
+    Epetra_BlockMap const &map = experiment.x0->Map();
+    Epetra_Import import(map, tmp->Map());
+    Teuchos::RCP<Epetra_Vector> x = Teuchos::rcp(new Epetra_Vector(map));
+    CHECK_ZERO(x->Import(*tmp, import, Insert));
+    delete tmp;
+
+    return x;
+}
 #endif //TRILINOS_MAJOR_MINOR_VERSION
@@ -4,11 +4,14 @@
 #include "TransientDecl.hpp"
 
 #include "GlobalDefinitions.H"
+#include "Philox.H"
 
 #include <vector>
+#include <map>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <random>
 
 template<class T>
 struct AMSExperiment {
@@ -18,6 +21,12 @@ struct AMSExperiment {
     std::vector<double> dlist;
     std::vector<double> tlist;
 
+    // Keys in the spill file of the states in xlist that were moved
+    // to disk, by their index in xlist, see Transient::limit_memory().
+    // Distances can occur more than once in dlist, so they can not be
+    // used as keys.
+    std::map<int, int> spilled;
+
     double max_distance;
     double time;
     double initial_time;
@@ -26,18 +35,23 @@ struct AMSExperiment {
     bool initialized;
     bool converged;
 
+    // Group of processes that stores xlist, see Transient::set_groups()
+    int group;
+
     AMSExperiment()
         :
         x0(),
         xlist(),
         dlist(),
         tlist(),
+        spilled(),
         max_distance(0.0),
         time(0.0),
         initial_time(0.0),
         return_time(0.0),
         initialized(false),
-        converged(false)
+        converged(false),
+        group(0)
         {}
 
     static bool sort(AMSExperiment<T> const *e1, AMSExperiment<T> const *e2)
@@ -64,7 +78,18 @@ Transient<T>::Transient()
     x0_(nullptr),
     mfpt_(-1),
     probability_(-1),
-    engine_initialized_(false)
+    engine_initialized_(false),
+    seed_(0),
+    draws_(0),
+    noise_stream_(0),
+    noise_step_(0),
+    ensemble_size_(1),
+    num_groups_(1),
+    group_(0),
+    num_eliminated_(-1),
+    max_memory_(-1),
+    spill_file_("spill.h5"),
+    spill_count_(0)
 {}
 
 template<class T>
@@ -75,7 +100,18 @@ Transient<T>::Transient(std::function<T(T const &, double)> time_step)
     x0_(nullptr),
     mfpt_(-1),
     probability_(-1),
-    engine_initialized_(false)
+    engine_initialized_(false),
+    seed_(0),
+    draws_(0),
+    noise_stream_(0),
+    noise_step_(0),
+    ensemble_size_(1),
+    num_groups_(1),
+    group_(0),
+    num_eliminated_(-1),
+    max_memory_(-1),
+    spill_file_("spill.h5"),
+    spill_count_(0)
 {}
 
 template<class T>
@@ -87,7 +123,18 @@ Transient<T>::Transient(std::function<T(T const &, double)> time_step,
     x0_(new T(x0)),
     mfpt_(-1),
     probability_(-1),
-    engine_initialized_(false)
+    engine_initialized_(false),
+    seed_(0),
+    draws_(0),
+    noise_stream_(0),
+    noise_step_(0),
+    ensemble_size_(1),
+    num_groups_(1),
+    group_(0),
+    num_eliminated_(-1),
+    max_memory_(-1),
+    spill_file_("spill.h5"),
+    spill_count_(0)
 {}
 
 template<class T>
@@ -102,7 +149,18 @@ Transient<T>::Transient(std::function<T(T const &, double)> time_step,
     vector_length_(vector_length),
     mfpt_(-1),
     probability_(-1),
-    engine_initialized_(false)
+    engine_initialized_(false),
+    seed_(0),
+    draws_(0),
+    noise_stream_(0),
+    noise_step_(0),
+    ensemble_size_(1),
+    num_groups_(1),
+    group_(0),
+    num_eliminated_(-1),
+    max_memory_(-1),
+    spill_file_("spill.h5"),
+    spill_count_(0)
 {}
 
 template<class T>
@@ -118,15 +176,23 @@ Transient<T>::Transient(std::function<T(T const &, double)> time_step,
     vector_length_(vector_length),
     mfpt_(-1),
     probability_(-1),
-    engine_initialized_(false)
+    engine_initialized_(false),
+    seed_(0),
+    draws_(0),
+    noise_stream_(0),
+    noise_step_(0),
+    ensemble_size_(1),
+    num_groups_(1),
+    group_(0),
+    num_eliminated_(-1),
+    max_memory_(-1),
+    spill_file_("spill.h5"),
+    spill_count_(0)
 {}
 
 template<class T>
 Transient<T>::~Transient()
 {
-    if (engine_initialized_)
-        delete engine_;
-
     if (x0_)
         delete x0_;
 }
@@ -163,12 +229,26 @@ void Transient<T>::set_parameters(ParameterList &params)
     // (T)AMS parameters
     maxit_ = params.get("maximum iterations", num_exp_ * 10);
 
+    // Number of experiments that is at least eliminated in every
+    // iteration. The default is one, also when the experiments are
+    // distributed over groups, in which case it is usually set to
+    // the number of groups.
+    num_eliminated_ = params.get("eliminated experiments", num_eliminated_);
+
+    // (T)AMS memory budget. Above it, the stored states that are
+    // furthest from being used for branching are moved to spill file.
+    max_memory_ = params.get("maximum memory (in MB)", -1.0) * 1e6;
+    spill_file_ = params.get("spill file", spill_file_);
+
     // Writing parameters
     read_ = params.get("read file", "");
     write_ = params.get("write file", "");
     write_final_ = params.get("write final state", true);
     write_steps_ = params.get("write steps", -1);
     write_time_steps_ = params.get("write time steps", -1);
+
+    // GPA and TAMS parameters, see set_ensemble_time_step()
+    ensemble_size_ = params.get("ensemble size", ensemble_size_);
 }
 
 template<class T>
@@ -225,7 +305,7 @@ void Transient<T>::transient_ams(
     double dt, double tmax,
     AMSExperiment<T> &experiment) const
 {
-    T x(experiment.xlist.back());
+    T x(load(experiment, experiment.xlist.size() - 1));
     double t = experiment.tlist.back() + dt;
     double tend = t + tmax;
 
@@ -270,7 +350,7 @@ void Transient<T>::transient_tams(
     double dt, double tmax,
     AMSExperiment<T> &experiment) const
 {
-    T x(experiment.xlist.back());
+    T x(load(experiment, experiment.xlist.size() - 1));
     double t = experiment.tlist.back() + dt;
 
     double max_distance = experiment.max_distance;
@@ -323,20 +403,171 @@ void Transient<T>::transient_gpa(
     experiment.x = x;
 }
 
+template<class T>
+void Transient<T>::transient_tams(
+    double dt, double tmax,
+    std::vector<AMSExperiment<T> *> const &experiments,
+    std::vector<std::uint64_t> const &streams) const
+{
+    int batch = ensemble_size();
+    for (int first = 0; first < (int)experiments.size(); first += batch)
+    {
+        int n = std::min(batch, (int)experiments.size() - first);
+        if (n == 1)
+        {
+            start_stream(streams[first]);
+            transient_tams(dt, tmax, *experiments[first]);
+            continue;
+        }
+
+        // The same as transient_tams() for every experiment, but
+        // with the time steps of the experiments that did not finish
+        // in one call
+        std::vector<T> x(n);
+        std::vector<double> t(n);
+        std::vector<double> max_distance(n);
+        std::vector<std::uint64_t> steps(n, 0);
+        std::vector<int> active;
+        for (int i = 0; i < n; i++)
+        {
+            AMSExperiment<T> &experiment = *experiments[first + i];
+            x[i] = load(experiment, experiment.xlist.size() - 1);
+            t[i] = experiment.tlist.back() + dt;
+            max_distance[i] = experiment.max_distance;
+            if (t[i] <= tmax)
+                active.push_back(i);
+        }
+
+        while (active.size() > 0)
+        {
+            std::vector<T> xa;
+            std::vector<std::pair<std::uint64_t, std::uint64_t> > noise;
+            for (int i: active)
+            {
+                xa.push_back(x[i]);
+                noise.push_back({streams[first + i], steps[i]++});
+            }
+
+            xa = std::move(ensemble_time_step_helper(xa, dt, noise));
+
+            std::vector<int> still_active;
+            for (int k = 0; k < (int)active.size(); k++)
+            {
+                int i = active[k];
+                AMSExperiment<T> &experiment = *experiments[first + i];
+                x[i] = xa[k];
+
+                double dist = dist_fun_(x[i]);
+                if (dist > 1 - bdist_)
+                {
+                    experiment.converged = true;
+                    experiment.xlist.push_back(x[i]);
+                    experiment.tlist.push_back(t[i]);
+                    experiment.dlist.push_back(1.0);
+                    max_distance[i] = 1.0;
+                    continue;
+                }
+                if (dist > max_distance[i] + dist_tol_)
+                {
+                    experiment.xlist.push_back(x[i]);
+                    experiment.tlist.push_back(t[i]);
+                    experiment.dlist.push_back(dist);
+                    max_distance[i] = dist;
+                }
+
+                t[i] += dt;
+                if (t[i] <= tmax)
+                    still_active.push_back(i);
+            }
+            active = still_active;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            AMSExperiment<T> &experiment = *experiments[first + i];
+            experiment.time = experiment.tlist.back();
+            experiment.max_distance = max_distance[i];
+        }
+    }
+}
+
+template<class T>
+void Transient<T>::transient_gpa(
+    double dt, double tmax,
+    std::vector<GPAExperiment<T> *> const &experiments,
+    std::vector<std::uint64_t> const &streams) const
+{
+    int batch = ensemble_size();
+    for (int first = 0; first < (int)experiments.size(); first += batch)
+    {
+        int n = std::min(batch, (int)experiments.size() - first);
+        if (n == 1)
+        {
+            start_stream(streams[first]);
+            transient_gpa(dt, tmax, *experiments[first]);
+            continue;
+        }
+
+        std::vector<T> x(n);
+        for (int i = 0; i < n; i++)
+            x[i] = experiments[first + i]->x;
+
+        std::vector<double> dist(n, -1);
+        std::vector<std::pair<std::uint64_t, std::uint64_t> > noise(n);
+        std::uint64_t step = 0;
+        for (double t = dt; t <= tmax; t += dt, step++)
+        {
+            for (int i = 0; i < n; i++)
+                noise[i] = {streams[first + i], step};
+
+            x = std::move(ensemble_time_step_helper(x, dt, noise));
+
+            for (int i = 0; i < n; i++)
+            {
+                dist[i] = dist_fun_(x[i]);
+                if (dist[i] > 1 - bdist_)
+                    experiments[first + i]->converged = true;
+            }
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            experiments[first + i]->distance = dist[i];
+            experiments[first + i]->x = x[i];
+        }
+    }
+}
+
 template<class T>
 void Transient<T>::naive(T const &x0) const
 {
     std::vector<GPAExperiment<T>> experiments(num_exp_);
 
-    int converged = 0;
+    std::vector<GPAExperiment<T> *> group_experiments;
+    std::vector<std::uint64_t> streams;
     for (int i = 0; i < num_exp_; i++)
     {
+        if (group_of(i) != group_)
+            continue;
+
         experiments[i].x = x0;
         experiments[i].converged = false;
-        transient_gpa(dt_, tmax_, experiments[i]);
+        group_experiments.push_back(&experiments[i]);
+        streams.push_back(i);
+    }
 
-        if (experiments[i].converged)
+    transient_gpa(dt_, tmax_, group_experiments, streams);
+
+    int converged = 0;
+    for (auto exp: group_experiments)
+        if (exp->converged)
             converged++;
+
+    if (groups())
+    {
+        std::vector<double> total(1, converged);
+        group_sum_(total);
+        converged = (int)total[0];
     }
 
     probability_ = (double)converged / (double)num_exp_;
@@ -376,12 +607,18 @@ double Transient<T>::ams_elimination(
     for (int i = its_; i < maxit_; i++)
     {
         minimal_experiments.clear();
+        double level = 0.0;
         if (unconverged_experiments.size() > 0 && unused_experiments.size() > 0)
         {
-            AMSExperiment<T> *minimal_exp = unconverged_experiments.back();
+            // Eliminate all experiments with a maximum distance that is
+            // not larger than the k-th lowest one
+            int k = std::min(num_eliminated(), (int)unconverged_experiments.size());
+            level = unconverged_experiments[
+                unconverged_experiments.size() - k]->max_distance;
+
             AMSExperiment<T> *exp = unconverged_experiments.back();
             while (unconverged_experiments.size() > 0 &&
-                   exp->max_distance == minimal_exp->max_distance)
+                   exp->max_distance <= level)
             {
                 minimal_experiments.push_back(exp);
                 unconverged_experiments.pop_back();
@@ -408,46 +645,123 @@ double Transient<T>::ams_elimination(
 
         its_++;
 
-        for (auto &exp: minimal_experiments)
+        int num_minimal = minimal_experiments.size();
+
+        // Select the experiments to branch from. The selection uses the
+        // same random numbers on all groups.
+        std::vector<AMSExperiment<T> *> branch_experiments;
+        for (int j = 0; j < num_minimal; j++)
         {
-            double max_distance = exp->max_distance;
             int rnd_idx = randint(0, unused_experiments.size()-1);
-            while (unused_experiments[rnd_idx]->max_distance <= exp->max_distance)
+            while (unused_experiments[rnd_idx]->max_distance <= level)
                 rnd_idx = randint(0, unused_experiments.size()-1);
+            branch_experiments.push_back(unused_experiments[rnd_idx]);
+        }
+
+        // Branch at the first state that reached the level. States
+        // that were moved to disk are loaded here, before any of the
+        // experiments continues.
+        std::vector<double> max_distances(num_minimal);
+        std::vector<T> branch_states(num_minimal);
+        std::vector<double> branch_points(2 * num_minimal, 0.0);
+        for (int j = 0; j < num_minimal; j++)
+        {
+            AMSExperiment<T> *exp = minimal_experiments[j];
+            AMSExperiment<T> *rnd_exp = branch_experiments[j];
+            max_distances[j] = exp->max_distance;
+            branch_states[j] = exp->x0;
+
+            if (rnd_exp->group != group_)
+                continue;
 
-            AMSExperiment<T> *rnd_exp = unused_experiments[rnd_idx];
             if (rnd_exp->dlist.size() == 0)
             {
-                ERROR("Experiment " << rnd_idx << " has size 0.", __FILE__, __LINE__);
+                ERROR("Experiment " << std::find(reactive_experiments.begin(),
+                                                 reactive_experiments.end(),
+                                                 rnd_exp) - reactive_experiments.begin()
+                      << " has size 0.", __FILE__, __LINE__);
             }
 
             int same_distance_idx = -1;
             while (++same_distance_idx < (int)rnd_exp->dlist.size() &&
-                   rnd_exp->dlist[same_distance_idx] < exp->max_distance);
+                   rnd_exp->dlist[same_distance_idx] < level);
 
             if (same_distance_idx == (int)rnd_exp->dlist.size())
             {
-                ERROR("Distance larger than " << exp->max_distance
+                ERROR("Distance larger than " << level
                       << " not found in experiment with max distance "
                       << rnd_exp->max_distance << ".", __FILE__, __LINE__);
             }
 
-            exp->xlist = std::vector<T>(
-                rnd_exp->xlist.begin(), rnd_exp->xlist.begin() + same_distance_idx + 1);
-            exp->dlist = std::vector<double>(
-                rnd_exp->dlist.begin(), rnd_exp->dlist.begin() + same_distance_idx + 1);
-            exp->tlist = std::vector<double>(
-                rnd_exp->tlist.begin(), rnd_exp->tlist.begin() + same_distance_idx + 1);
-
-            if (method == "AMS")
-                transient_ams(dt, tmax, *exp);
-            else if (method == "TAMS")
-                transient_tams(dt, tmax, *exp);
-            else
+            branch_states[j] = load(*rnd_exp, same_distance_idx);
+            branch_points[2 * j] = rnd_exp->dlist[same_distance_idx];
+            branch_points[2 * j + 1] = rnd_exp->tlist[same_distance_idx];
+        }
+
+        if (groups())
+            group_sum_(branch_points);
+
+        // Experiment j continues on group j from only the branch
+        // state, which is sent there by the group that stores it. The
+        // states before the branch state are not copied, since the
+        // levels do not decrease, so they are never used for branching
+        // again.
+        for (int j = 0; j < num_minimal; j++)
+        {
+            AMSExperiment<T> *exp = minimal_experiments[j];
+            AMSExperiment<T> *rnd_exp = branch_experiments[j];
+
+            int from = rnd_exp->group;
+            int to = group_of(j);
+            if (from != to)
+                branch_states[j] = group_transfer_(branch_states[j], from, to);
+
+            exp->xlist.clear();
+            exp->dlist.clear();
+            exp->tlist.clear();
+            exp->spilled.clear();
+            if (to == group_)
             {
-                ERROR("Method " << method << " does not exist.", __FILE__, __LINE__);
+                exp->xlist.push_back(branch_states[j]);
+                exp->dlist.push_back(branch_points[2 * j]);
+                exp->tlist.push_back(branch_points[2 * j + 1]);
             }
+            exp->group = to;
+        }
+
+        // Every experiment of every iteration has its own noise
+        std::vector<AMSExperiment<T> *> group_experiments;
+        std::vector<std::uint64_t> streams;
+        for (auto &exp: minimal_experiments)
+        {
+            if (exp->group != group_)
+                continue;
+
+            group_experiments.push_back(exp);
+            streams.push_back((std::uint64_t)its_ * experiments.size() +
+                              (exp - experiments.data()));
+        }
+
+        if (method == "AMS")
+        {
+            for (int j = 0; j < (int)group_experiments.size(); j++)
+            {
+                start_stream(streams[j]);
+                transient_ams(dt, tmax, *group_experiments[j]);
+            }
+        }
+        else if (method == "TAMS")
+            transient_tams(dt, tmax, group_experiments, streams);
+        else
+        {
+            ERROR("Method " << method << " does not exist.", __FILE__, __LINE__);
+        }
+
+        sync_experiments(minimal_experiments);
 
+        for (int j = 0; j < num_minimal; j++)
+        {
+            AMSExperiment<T> *exp = minimal_experiments[j];
             if (exp->converged)
                 converged++;
             else
@@ -456,7 +770,7 @@ double Transient<T>::ams_elimination(
             INFO(method << ": " << its_ << " / " << maxit_ << ", "
                  << converged << " / " << num_exp_
                  << " converged with max distance "
-                 << max_distance << " -> "
+                 << max_distances[j] << " -> "
                  << exp->max_distance << " and t="
                  << exp->initial_time + exp->time
                  << " for experiment "
@@ -476,7 +790,7 @@ double Transient<T>::ams_elimination(
         for (auto exp: reactive_experiments)
             min_max_distance = std::min(min_max_distance, exp->max_distance);
 
-        if (its_ % 10 == 0)
+        if (its_ % 10 == 0 || max_memory_ > 0)
         {
             INFO("Starting cleanup");
             for (auto exp: unused_experiments)
@@ -487,6 +801,12 @@ double Transient<T>::ams_elimination(
 
                 if (min_max_idx > 0)
                 {
+                    std::map<int, int> spilled;
+                    for (auto &key: exp->spilled)
+                        if (key.first >= min_max_idx)
+                            spilled[key.first - min_max_idx] = key.second;
+                    exp->spilled = spilled;
+
                     exp->xlist = std::vector<T>(
                         exp->xlist.begin() + min_max_idx,
                         exp->xlist.end());
@@ -501,6 +821,8 @@ double Transient<T>::ams_elimination(
             INFO("Finished cleanup");
         }
 
+        limit_memory(experiments);
+
         write_helper(experiments, its_);
     }
     INFO("");
@@ -521,13 +843,22 @@ void Transient<T>::ams(T const &x0) const
     INFO("Using AMS with an estimated memory usage of: "
          << mem2string((long long)(1.0 / dist_tol_ * num_exp_ *
                                    vector_length_ * sizeof(double))));
+    if (max_memory_ > 0)
+    {
+        INFO("States are moved to " << spill_file_name() << " above "
+             << mem2string(max_memory_));
+    }
 
     std::vector<AMSExperiment<T>> experiments(num_init_exp_);
     for (int i = 0; i < num_init_exp_; i++)
+    {
         experiments[i].x0 = x0;
+        experiments[i].group = group_of(i);
+    }
 
     its_ = 0;
     time_steps_ = 0;
+    spill_count_ = 0;
     ell_.clear();
 
     if (read_ != "")
@@ -539,9 +870,10 @@ void Transient<T>::ams(T const &x0) const
 
     for (int i = 0; i < num_init_exp_; i++)
     {
-        if (experiments[i].initialized)
+        if (experiments[i].initialized || experiments[i].group != group_)
             continue;
 
+        start_stream(i);
         transient_start(x0, dt_, tmax, experiments[i]);
 
         if (experiments[i].xlist.size() == 0)
@@ -557,8 +889,11 @@ void Transient<T>::ams(T const &x0) const
             experiments[i].xlist = std::vector<T>();
             experiments[i].dlist = std::vector<double>();
             experiments[i].tlist = std::vector<double>();
+            experiments[i].spilled.clear();
         }
 
+        limit_memory(experiments);
+
         if (experiments[i].converged)
             converged++;
 
@@ -571,6 +906,11 @@ void Transient<T>::ams(T const &x0) const
     }
     INFO("");
 
+    std::vector<AMSExperiment<T> *> all_experiments;
+    for (auto &exp: experiments)
+        all_experiments.push_back(&exp);
+    sync_experiments(all_experiments);
+
     double alpha = ams_elimination("AMS", experiments, dt_, tmax);
 
     double total_tr = 0;
@@ -610,13 +950,22 @@ void Transient<T>::tams(T const &x0) const
     INFO("Using TAMS with an estimated memory usage of: "
          << mem2string((long long)(tmax_ / dt_ * num_exp_ *
                                    vector_length_ * sizeof(double))));
+    if (max_memory_ > 0)
+    {
+        INFO("States are moved to " << spill_file_name() << " above "
+             << mem2string(max_memory_));
+    }
 
     std::vector<AMSExperiment<T>> experiments(num_exp_);
     for (int i = 0; i < num_exp_; i++)
+    {
         experiments[i].x0 = x0;
+        experiments[i].group = group_of(i);
+    }
 
     its_ = 0;
     time_steps_ = 0;
+    spill_count_ = 0;
     ell_.clear();
 
     if (read_ != "")
@@ -625,31 +974,57 @@ void Transient<T>::tams(T const &x0) const
     int converged = 0;
     time_steps_previous_write_ = 0;
 
+    std::vector<int> uninitialized;
     for (int i = 0; i < num_exp_; i++)
+        if (!experiments[i].initialized && experiments[i].group == group_)
+            uninitialized.push_back(i);
+
+    // Experiments are initialized in batches of the ensemble size
+    int batch = ensemble_size();
+    for (int first = 0; first < (int)uninitialized.size(); first += batch)
     {
-        if (experiments[i].initialized)
-            continue;
+        int last = std::min(first + batch, (int)uninitialized.size());
 
-        experiments[i].xlist.push_back(x0);
-        experiments[i].dlist.push_back(0);
-        experiments[i].tlist.push_back(0);
+        std::vector<AMSExperiment<T> *> batch_experiments;
+        std::vector<std::uint64_t> streams;
+        for (int j = first; j < last; j++)
+        {
+            int i = uninitialized[j];
+            experiments[i].xlist.push_back(x0);
+            experiments[i].dlist.push_back(0);
+            experiments[i].tlist.push_back(0);
 
-        transient_tams(dt_, tmax_, experiments[i]);
+            batch_experiments.push_back(&experiments[i]);
+            streams.push_back(i);
+        }
 
-        experiments[i].initialized = true;
+        transient_tams(dt_, tmax_, batch_experiments, streams);
 
-        if (experiments[i].converged)
-            converged++;
+        for (int j = first; j < last; j++)
+        {
+            int i = uninitialized[j];
+            experiments[i].initialized = true;
 
-        INFO("Initialization: " << i+1 << " / " << num_exp_ << ", "
-             << converged << " / " << num_exp_
-             << " converged with t="
-             << experiments[i].time);
+            if (experiments[i].converged)
+                converged++;
 
-        write_helper(experiments, i+1);
+            limit_memory(experiments);
+
+            INFO("Initialization: " << i+1 << " / " << num_exp_ << ", "
+                 << converged << " / " << num_exp_
+                 << " converged with t="
+                 << experiments[i].time);
+
+            write_helper(experiments, i+1);
+        }
     }
     INFO("");
 
+    std::vector<AMSExperiment<T> *> all_experiments;
+    for (auto &exp: experiments)
+        all_experiments.push_back(&exp);
+    sync_experiments(all_experiments);
+
     probability_ = ams_elimination("TAMS", experiments, dt_, tmax_);
 
     INFO("Transition probability T=" << tmax_ << ": " << probability_);
@@ -676,7 +1051,8 @@ void Transient<T>::gpa(T const &x0) const
         experiments[i].converged = false;
     }
 
-    for (double t = tstep_; t <= tmax_; t += tstep_)
+    int gpa_step = 0;
+    for (double t = tstep_; t <= tmax_; t += tstep_, gpa_step++)
     {
         // Compute the mean weight
         double sum = 0.0;
@@ -697,6 +1073,9 @@ void Transient<T>::gpa(T const &x0) const
                 if (cumsum >= val)
                 {
                     experiments[i] = old_experiments[j];
+                    if (groups())
+                        experiments[i].x = group_transfer_(
+                            old_experiments[j].x, group_of(j), group_of(i));
                     break;
                 }
                 if (j == num_exp_-1)
@@ -708,10 +1087,39 @@ void Transient<T>::gpa(T const &x0) const
         }
 
         // Step until the next tstep and recompute weights
+        std::vector<GPAExperiment<T> *> group_experiments;
+        std::vector<std::uint64_t> streams;
+        for (int i = 0; i < num_exp_; i++)
+        {
+            if (group_of(i) != group_)
+                continue;
+
+            group_experiments.push_back(&experiments[i]);
+            streams.push_back((std::uint64_t)gpa_step * num_exp_ + i);
+        }
+        transient_gpa(dt_, tstep_, group_experiments, streams);
+
+        if (groups())
+        {
+            std::vector<double> values(2 * num_exp_, 0.0);
+            for (int i = 0; i < num_exp_; i++)
+            {
+                if (group_of(i) != group_)
+                    continue;
+                values[2 * i] = experiments[i].distance;
+                values[2 * i + 1] = experiments[i].converged;
+            }
+            group_sum_(values);
+            for (int i = 0; i < num_exp_; i++)
+            {
+                experiments[i].distance = values[2 * i];
+                experiments[i].converged = values[2 * i + 1] > 0.5;
+            }
+        }
+
         int converged = 0;
         for (int i = 0; i < num_exp_; i++)
         {
-            transient_gpa(dt_, tstep_, experiments[i]);
             experiments[i].weight = W(experiments[i].distance);
             experiments[i].probability *= eta / experiments[i].weight;
 
@@ -736,72 +1144,233 @@ void Transient<T>::gpa(T const &x0) const
 template<class T>
 void Transient<T>::set_random_engine(unsigned int seed)
 {
-    if (engine_initialized_)
-        delete engine_;
+    seed_ = seed;
+    draws_ = 0;
+    engine_initialized_ = true;
+}
 
-    std::seed_seq seeder{seed};
-    engine_ = new std::mt19937_64(seeder);
+template<class T>
+void Transient<T>::set_noise_index(
+    std::function<void(std::uint64_t, std::uint64_t)> fn)
+{
+    noise_index_ = fn;
+}
 
-    randint_ = [this](int a, int b) {
-        std::uniform_int_distribution<int> int_distribution(a, b);
-        int val = int_distribution(*engine_);
-        return val;
-    };
-    randreal_ = [this](int a, int b) {
-        std::uniform_real_distribution<double> real_distribution(a, b);
-        double val = real_distribution(*engine_);
-        return val;
-    };
-    engine_initialized_ = true;
+template<class T>
+void Transient<T>::set_ensemble_time_step(
+    std::function<std::vector<T>(
+        std::vector<T> const &, double,
+        std::vector<std::pair<std::uint64_t, std::uint64_t> > const &)> fn)
+{
+    ensemble_time_step_ = fn;
 }
 
 template<class T>
-int Transient<T>::randint(int a, int b) const
+int Transient<T>::ensemble_size() const
 {
-    if (engine_initialized_)
-        return randint_(a, b);
+    if (!ensemble_time_step_)
+        return 1;
+    return std::max(ensemble_size_, 1);
+}
 
-    static bool first = true;
-    if (first)
+template<class T>
+void Transient<T>::start_stream(std::uint64_t stream) const
+{
+    noise_stream_ = stream;
+    noise_step_ = 0;
+}
+
+template<class T>
+void Transient<T>::set_groups(int num_groups, int group,
+                              std::function<void(std::vector<double> &)> sum,
+                              std::function<T(T const &, int, int)> transfer)
+{
+    num_groups_ = num_groups;
+    group_ = group;
+    group_sum_ = sum;
+    group_transfer_ = transfer;
+
+    if (read_ != "" || write_ != "")
     {
-        first = false;
-        WARNING("Random engine not initialized.", __FILE__, __LINE__);
+        WARNING("Reading and writing transient data is not supported "
+                "with groups.", __FILE__, __LINE__);
+        read_ = "";
+        write_ = "";
     }
 
-    static thread_local std::random_device rd;
-    static thread_local std::seed_seq seeder{rd()};
-    static thread_local std::mt19937_64 engine(seeder);
-    std::uniform_int_distribution<int> int_distribution(a, b);
-    return int_distribution(engine);
+    // All groups use the seed of the first group
+    if (!engine_initialized_)
+        seed_ = std::random_device()();
+
+    std::vector<double> seed(1, group_ == 0 ? seed_ : 0.0);
+    group_sum_(seed);
+    set_random_engine((unsigned int)seed[0]);
 }
 
 template<class T>
-int Transient<T>::randreal(double a, double b) const
+int Transient<T>::num_eliminated() const
 {
-    if (engine_initialized_)
-        return randreal_(a, b);
+    if (num_eliminated_ > 0)
+        return num_eliminated_;
+    return 1;
+}
 
-    static bool first = true;
-    if (first)
+template<class T>
+void Transient<T>::sync_experiments(
+    std::vector<AMSExperiment<T> *> const &experiments) const
+{
+    if (!groups())
+        return;
+
+    const int n = 6;
+    std::vector<double> values(n * experiments.size(), 0.0);
+    for (size_t i = 0; i < experiments.size(); i++)
     {
-        first = false;
-        WARNING("Random engine not initialized.", __FILE__, __LINE__);
+        AMSExperiment<T> const &exp = *experiments[i];
+        if (exp.group != group_)
+            continue;
+
+        values[n * i]     = exp.max_distance;
+        values[n * i + 1] = exp.time;
+        values[n * i + 2] = exp.initial_time;
+        values[n * i + 3] = exp.return_time;
+        values[n * i + 4] = exp.initialized;
+        values[n * i + 5] = exp.converged;
+    }
+
+    group_sum_(values);
+
+    for (size_t i = 0; i < experiments.size(); i++)
+    {
+        AMSExperiment<T> &exp = *experiments[i];
+        exp.max_distance = values[n * i];
+        exp.time         = values[n * i + 1];
+        exp.initial_time = values[n * i + 2];
+        exp.return_time  = values[n * i + 3];
+        exp.initialized  = values[n * i + 4] > 0.5;
+        exp.converged    = values[n * i + 5] > 0.5;
+    }
+}
+
+template<class T>
+std::string Transient<T>::spill_file_name() const
+{
+    if (!groups())
+        return spill_file_;
+
+    // Every group has its own file
+    std::string name = spill_file_;
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+        dot = name.size();
+    return name.substr(0, dot) + "_" + std::to_string(group_) + name.substr(dot);
+}
+
+template<class T>
+void Transient<T>::limit_memory(std::vector<AMSExperiment<T> > &experiments) const
+{
+    if (max_memory_ <= 0)
+        return;
+
+    struct State
+    {
+        double distance;
+        AMSExperiment<T> *experiment;
+        int idx;
+    };
+
+    double state_size = vector_length_ * sizeof(double);
+    double memory = 0.0;
+    int num_spilled = 0;
+    std::vector<State> states;
+    for (auto &exp: experiments)
+    {
+        num_spilled += exp.spilled.size();
+        for (int j = 0; j < (int)exp.xlist.size(); j++)
+        {
+            if (exp.spilled.count(j))
+                continue;
+
+            states.push_back({exp.dlist[j], &exp, j});
+            memory += state_size;
+        }
+    }
+
+    // States that are no longer used leave their data behind in the
+    // spill file. Once that is more than half of it, the file is
+    // rewritten, so it stays below twice the size of the spilled
+    // states.
+    if (spill_count_ > 2 * num_spilled)
+        compact_spill_file(experiments);
+
+    if (memory <= max_memory_)
+        return;
+
+    // Branching happens at the first state above the lowest maximum
+    // distance, so the states with the largest distance are needed last
+    std::sort(states.begin(), states.end(),
+              [](State const &a, State const &b) {
+                  return a.distance > b.distance; });
+
+    std::vector<std::pair<AMSExperiment<T> *, int> > spill_states;
+    for (auto &state: states)
+    {
+        if (memory <= max_memory_)
+            break;
+        spill_states.push_back({state.experiment, state.idx});
+        memory -= state_size;
     }
 
-    static thread_local std::random_device rd;
-    static thread_local std::seed_seq seeder{rd()};
-    static thread_local std::mt19937_64 engine(seeder);
-    std::uniform_real_distribution<double> real_distribution(a, b);
-    return real_distribution(engine);
+    spill(spill_states);
+}
+
+template<class T>
+int Transient<T>::randint(int a, int b) const
+{
+    int val = a + (int)(randreal(0.0, 1.0) * (b - a + 1));
+    return std::min(val, b);
+}
+
+template<class T>
+double Transient<T>::randreal(double a, double b) const
+{
+    unsigned int seed = seed_;
+    if (!engine_initialized_)
+    {
+        static bool first = true;
+        if (first)
+        {
+            first = false;
+            WARNING("Random engine not initialized.", __FILE__, __LINE__);
+        }
+
+        static unsigned int random_seed = std::random_device()();
+        seed = random_seed;
+    }
+
+    // The selection draws from a stream that is not used for noise
+    double u = Philox::uniform(seed, ~(std::uint64_t)0, draws_++, 0);
+    return a + u * (b - a);
 }
 
 template<class T>
 T Transient<T>::time_step_helper(T const &x, double dt) const
 {
     time_steps_++;
+    if (noise_index_)
+        noise_index_(noise_stream_, noise_step_++);
     return std::move(time_step_(x, dt));
 }
 
+template<class T>
+std::vector<T> Transient<T>::ensemble_time_step_helper(
+    std::vector<T> const &x, double dt,
+    std::vector<std::pair<std::uint64_t, std::uint64_t> > const &noise) const
+{
+    time_steps_ += x.size();
+    return std::move(ensemble_time_step_(x, dt, noise));
+}
+
 template<class T>
 void Transient<T>::write_helper(std::vector<AMSExperiment<T> > const &experiments,
                                 int its) const
@@ -867,6 +1436,33 @@ void Transient<T>::write(
     WARNING("Writing transient data not implemented.", __FILE__, __LINE__);
 }
 
+template<typename T>
+void Transient<T>::spill(
+    std::vector<std::pair<AMSExperiment<T> *, int> > const &states) const
+{
+    static bool first = true;
+    if (first && states.size() > 0)
+    {
+        first = false;
+        WARNING("Moving states to disk not implemented.", __FILE__, __LINE__);
+    }
+}
+
+template<typename T>
+void Transient<T>::compact_spill_file(
+    std::vector<AMSExperiment<T> > &experiments) const
+{}
+
+template<typename T>
+T Transient<T>::load(AMSExperiment<T> const &experiment, int idx) const
+{
+    if (experiment.spilled.count(idx))
+    {
+        ERROR("Loading states from disk not implemented.", __FILE__, __LINE__);
+    }
+    return experiment.xlist[idx];
+}
+
 template<class T>
 double Transient<T>::get_probability()
 {
@@ -896,6 +1492,31 @@ void Transient<Teuchos::RCP<const Epetra_Vector> >::write(
     std::string const &name,
     std::vector<AMSExperiment<Teuchos::RCP<const Epetra_Vector> > > const &experiments) const;
 
+template<>
+void Transient<Teuchos::RCP<const Epetra_Vector> >::spill(
+    std::vector<std::pair<AMSExperiment<Teuchos::RCP<const Epetra_Vector> > *,
+                          int> > const &states) const;
+
+template<>
+void Transient<Teuchos::RCP<const Epetra_Vector> >::compact_spill_file(
+    std::vector<AMSExperiment<Teuchos::RCP<const Epetra_Vector> > > &experiments) const;
+
+template<>
+Teuchos::RCP<const Epetra_Vector> Transient<Teuchos::RCP<const Epetra_Vector> >::load(
+    AMSExperiment<Teuchos::RCP<const Epetra_Vector> > const &experiment, int idx) const;
+
 #endif //TRILINOS_MAJOR_MINOR_VERSION
 
+namespace Teuchos { template<class T> class RCP; }
+class Epetra_Comm;
+class Epetra_Vector;
+
+//! Distribute the experiments of transient over the groups of
+//! processes in comm that were created by Utils::SplitComm. The
+//! model of transient should be created on groupComm.
+void set_transient_groups(
+    Transient<Teuchos::RCP<const Epetra_Vector> > &transient,
+    Teuchos::RCP<Epetra_Comm> comm, Teuchos::RCP<Epetra_Comm> groupComm,
+    int numGroups, int group);
+
 #endif
@@ -1,8 +1,11 @@
 #ifndef TRANSIENTDECL_HPP
 #define TRANSIENTDECL_HPP
 
-#include <random>
+#include <cstdint>
 #include <functional>
+#include <string>
+#include <vector>
+#include <utility>
 
 template<class T>
 struct AMSExperiment;
@@ -55,13 +58,34 @@ protected:
     mutable double mfpt_;
     mutable double probability_;
 
-    // RNG methods
+    // Counter-based RNG (see Philox.H). The selection and resampling
+    // use the counter draws_, the noise of the time steps uses the
+    // stream of the experiment and its step.
     bool engine_initialized_;
-    std::function<int(int, int)> randint_;
-    std::function<double(double, double)> randreal_;
-
-    // Random engine. FIXME: Does not work with omp!!!
-    std::mt19937_64 *engine_;
+    unsigned int seed_;
+    mutable std::uint64_t draws_;
+
+    std::function<void(std::uint64_t, std::uint64_t)> noise_index_;
+    mutable std::uint64_t noise_stream_;
+    mutable std::uint64_t noise_step_;
+
+    // Time step of an ensemble, see set_ensemble_time_step()
+    std::function<std::vector<T>(
+        std::vector<T> const &, double,
+        std::vector<std::pair<std::uint64_t, std::uint64_t> > const &)> ensemble_time_step_;
+    int ensemble_size_;
+
+    // Parallel ensembles, see set_groups()
+    int num_groups_;
+    int group_;
+    int num_eliminated_;
+    std::function<void(std::vector<double> &)> group_sum_;
+    std::function<T(T const &, int, int)> group_transfer_;
+
+    // Memory budget for the stored states in bytes, see limit_memory()
+    double max_memory_;
+    std::string spill_file_;
+    mutable int spill_count_;
 
 public:
     Transient();
@@ -102,6 +126,20 @@ public:
         double dt, double tmax,
         GPAExperiment<T> &experiment) const;
 
+    //! transient_tams() and transient_gpa() for a number of
+    //! experiments, where experiment i uses the noise of streams[i].
+    //! With an ensemble time step, the experiments are stepped
+    //! together in batches of the ensemble size.
+    void transient_tams(
+        double dt, double tmax,
+        std::vector<AMSExperiment<T> *> const &experiments,
+        std::vector<std::uint64_t> const &streams) const;
+
+    void transient_gpa(
+        double dt, double tmax,
+        std::vector<GPAExperiment<T> *> const &experiments,
+        std::vector<std::uint64_t> const &streams) const;
+
     double ams_elimination(
         std::string const &method,
         std::vector<AMSExperiment<T>> &experiments,
@@ -128,17 +166,91 @@ public:
 
     void set_random_engine(unsigned int seed);
 
+    //! Called with the stream and step of the noise before every
+    //! time step, see StochasticBase::set_noise_index(). Every
+    //! experiment in an AMS/TAMS iteration has its own stream, so the
+    //! noise does not depend on the group that computes it.
+    void set_noise_index(std::function<void(std::uint64_t, std::uint64_t)> fn);
+
+    //! Step an ensemble of states with one call, for instance with a
+    //! shared Jacobian. The time step gets the states, the time step
+    //! size and for every state the stream and step of its noise (see
+    //! set_noise_index()), and is used in GPA and TAMS when the
+    //! "ensemble size" parameter is larger than one.
+    void set_ensemble_time_step(
+        std::function<std::vector<T>(
+            std::vector<T> const &, double,
+            std::vector<std::pair<std::uint64_t, std::uint64_t> > const &)> fn);
+
+    //! Distribute the experiments over num_groups groups of
+    //! processes, each with its own model, of which this is group
+    //! group. Every group calls the methods in the same way.
+    //!  sum(v): replace v by the sum over the groups of v, where
+    //!          every group contributes once
+    //!  transfer(x, from, to): return state x of group from on
+    //!          group to, other groups get x back
+    //! The selection in AMS/TAMS and the resampling in GPA use the
+    //! same random numbers on every group.
+    void set_groups(int num_groups, int group,
+                    std::function<void(std::vector<double> &)> sum,
+                    std::function<T(T const &, int, int)> transfer);
+
     double get_probability();
     double get_mfpt();
 
 protected:
     int randint(int a, int b) const;
-    int randreal(double a, double b) const;
+    double randreal(double a, double b) const;
+
+    //! use the noise of stream in the next time steps
+    void start_stream(std::uint64_t stream) const;
 
     T time_step_helper(T const &x, double dt) const;
 
+    //! time step of the states x, where state i uses noise[i]
+    std::vector<T> ensemble_time_step_helper(
+        std::vector<T> const &x, double dt,
+        std::vector<std::pair<std::uint64_t, std::uint64_t> > const &noise) const;
+
+    //! number of experiments that is stepped together, 1 without an
+    //! ensemble time step
+    int ensemble_size() const;
+
+    //! true if the experiments are distributed over groups
+    bool groups() const { return static_cast<bool>(group_sum_); }
+
+    //! group that runs experiment i of an ensemble
+    int group_of(int i) const { return i % num_groups_; }
+
+    //! number of experiments that is at least eliminated in every
+    //! AMS/TAMS iteration, 1 unless "eliminated experiments" is set.
+    //! With groups, setting it to the number of groups keeps all
+    //! groups busy, at the cost of a larger variance.
+    int num_eliminated() const;
+
+    //! copy the scalar data of the experiments from the group that
+    //! stores them to all groups
+    void sync_experiments(std::vector<AMSExperiment<T> *> const &experiments) const;
+
     void write_helper(std::vector<AMSExperiment<T> > const &experiments,
                       int its) const;
+
+    //! move stored states to disk until their memory usage is below
+    //! the budget
+    void limit_memory(std::vector<AMSExperiment<T> > &experiments) const;
+
+    std::string spill_file_name() const;
+
+    //! move state idx of the experiments to disk
+    void spill(std::vector<std::pair<AMSExperiment<T> *, int> > const &states) const;
+
+    //! rewrite the spill file with only the states that are still
+    //! spilled
+    void compact_spill_file(std::vector<AMSExperiment<T> > &experiments) const;
+
+    //! state idx of the experiment, which is read from disk if it
+    //! was moved there
+    T load(AMSExperiment<T> const &experiment, int idx) const;
 };
 
 #endif